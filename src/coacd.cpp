@@ -1,12 +1,14 @@
 #include "coacd.h"
 
 #include <godot_cpp/core/class_db.hpp>
+#include <godot_cpp/templates/hash_map.hpp>
 #include <godot_cpp/variant/utility_functions.hpp>
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/base_sink.h>
 
 #include "../CoACD/public/coacd.h"
 #include "../CoACD/src/model_obj.h"
+#include "../CoACD/src/clip.h"
 
 using namespace godot;
 
@@ -71,11 +73,269 @@ namespace
         }
         void flush_() override {}
     };
+
+    bool validate_settings(const Ref<CoACDSettings> &settings)
+    {
+        ERR_FAIL_COND_V_EDMSG((settings->get_threshold() > 1), false, "CoACD threshold > 1 (should be 0.01-1).");
+        ERR_FAIL_COND_V_EDMSG((settings->get_threshold() < 0.01), false, "CoACD threshold < 0.01 (should be 0.01-1).");
+
+        ERR_FAIL_COND_V_EDMSG((settings->get_preprocess_resolution() > 1000), false, "CoACD preprocess resolution > 1000 (should be 20-100).");
+        ERR_FAIL_COND_V_EDMSG((settings->get_preprocess_resolution() < 5), false, "CoACD preprocess resolution < 5 (should be 20-100).");
+
+        return true;
+    }
+
+    coacd::Mesh build_coacd_mesh(const PackedVector3Array &points)
+    {
+        coacd::Mesh coacd_mesh;
+        std::vector<Vector3> unique_vertices;
+        std::vector<int> triangle_indices;
+        HashMap<Vector3, int> vertex_lookup;
+        const Vector3 snap_step(CMP_EPSILON, CMP_EPSILON, CMP_EPSILON);
+
+        for (int i = 0; i < points.size(); i += 3)
+        {
+            const Vector3 &v1 = points[i];
+            const Vector3 &v2 = points[i + 1];
+            const Vector3 &v3 = points[i + 2];
+
+            for (const Vector3 &v : {v1, v2, v3})
+            {
+                const Vector3 key = v.snapped(snap_step);
+                int vertex_idx;
+                HashMap<Vector3, int>::Iterator E = vertex_lookup.find(key);
+                if (E)
+                {
+                    vertex_idx = E->value;
+                }
+                else
+                {
+                    vertex_idx = unique_vertices.size();
+                    unique_vertices.push_back(v);
+                    vertex_lookup.insert(key, vertex_idx);
+                }
+
+                triangle_indices.push_back(vertex_idx);
+            }
+        }
+
+        coacd_mesh.vertices.reserve(unique_vertices.size());
+        for (const Vector3 &v : unique_vertices)
+        {
+            coacd_mesh.vertices.push_back({v.x, v.y, v.z});
+        }
+
+        coacd_mesh.indices.reserve(triangle_indices.size() / 3);
+        for (int i = 0; i < triangle_indices.size(); i += 3)
+        {
+            coacd_mesh.indices.push_back({triangle_indices[i + 0],
+                                          triangle_indices[i + 1],
+                                          triangle_indices[i + 2]});
+        }
+
+        coacd::Model coacd_model;
+        coacd_model.Load(coacd_mesh.vertices, coacd_mesh.indices);
+        double mesh_vol = coacd::MeshVolume(coacd_model);
+        if (mesh_vol < 0)
+        {
+            for (int i = 0; i < (int)coacd_mesh.indices.size(); i++)
+                std::swap(coacd_mesh.indices[i][0], coacd_mesh.indices[i][1]);
+        }
+
+        return coacd_mesh;
+    }
+
+    double longest_extent(const coacd::Mesh &coacd_mesh)
+    {
+        AABB bounds;
+        for (size_t i = 0; i < coacd_mesh.vertices.size(); i++)
+        {
+            const auto &v = coacd_mesh.vertices[i];
+            if (i == 0)
+            {
+                bounds = AABB(Vector3(v[0], v[1], v[2]), Vector3());
+            }
+            else
+            {
+                bounds.expand_to(Vector3(v[0], v[1], v[2]));
+            }
+        }
+        return bounds.get_longest_axis_size();
+    }
+
+    // Keeps the part of the closed mesh inside the region. CoACD caps every
+    // cut, so the result is closed as well. Returns false if a cut fails.
+    // Clip's epsilons are tuned for CoACD's normalized [-1, 1] range, so the
+    // cuts are made in that space and the result is mapped back afterwards.
+    bool clip_to_region(const coacd::Mesh &coacd_mesh, const AABB &region, coacd::Mesh &region_mesh)
+    {
+        AABB bounds;
+        for (size_t i = 0; i < coacd_mesh.vertices.size(); i++)
+        {
+            const auto &v = coacd_mesh.vertices[i];
+            if (i == 0)
+            {
+                bounds = AABB(Vector3(v[0], v[1], v[2]), Vector3());
+            }
+            else
+            {
+                bounds.expand_to(Vector3(v[0], v[1], v[2]));
+            }
+        }
+
+        const double extent = bounds.get_longest_axis_size();
+        ERR_FAIL_COND_V(extent <= 0, false);
+
+        const Vector3 center = bounds.get_center();
+        const double to_unit = 2.0 / extent;
+
+        std::vector<std::array<double, 3>> unit_vertices;
+        unit_vertices.reserve(coacd_mesh.vertices.size());
+        for (const auto &v : coacd_mesh.vertices)
+        {
+            unit_vertices.push_back({(v[0] - center.x) * to_unit,
+                                     (v[1] - center.y) * to_unit,
+                                     (v[2] - center.z) * to_unit});
+        }
+
+        coacd::Model model;
+        model.Load(unit_vertices, coacd_mesh.indices);
+
+        const Vector3 lo = (region.position - center) * to_unit;
+        const Vector3 hi = (region.get_end() - center) * to_unit;
+        coacd::Plane planes[6] = {
+            coacd::Plane(1, 0, 0, -lo.x),
+            coacd::Plane(-1, 0, 0, hi.x),
+            coacd::Plane(0, 1, 0, -lo.y),
+            coacd::Plane(0, -1, 0, hi.y),
+            coacd::Plane(0, 0, 1, -lo.z),
+            coacd::Plane(0, 0, -1, hi.z)};
+
+        for (coacd::Plane &plane : planes)
+        {
+            bool has_inside = false;
+            bool has_outside = false;
+            for (const auto &p : model.points)
+            {
+                double side = plane.a * p[0] + plane.b * p[1] + plane.c * p[2] + plane.d;
+                has_inside = has_inside || side > 0;
+                has_outside = has_outside || side < 0;
+            }
+
+            if (!has_inside)
+            {
+                region_mesh = coacd::Mesh();
+                return true;
+            }
+            if (!has_outside)
+            {
+                continue;
+            }
+
+            coacd::Model pos, neg;
+            double cut_area;
+            if (!coacd::Clip(model, pos, neg, plane, cut_area))
+            {
+                return false;
+            }
+            model = pos;
+        }
+
+        const double to_world = extent / 2.0;
+
+        region_mesh.vertices.clear();
+        region_mesh.vertices.reserve(model.points.size());
+        for (const auto &p : model.points)
+        {
+            region_mesh.vertices.push_back({p[0] * to_world + center.x,
+                                            p[1] * to_world + center.y,
+                                            p[2] * to_world + center.z});
+        }
+        region_mesh.indices = model.triangles;
+        return true;
+    }
+
+    // CoACD normalizes its input, so the threshold and preprocess resolution
+    // are relative to the mesh extent. scale is the extent of coacd_mesh over
+    // the extent of the mesh the settings were tuned for.
+    std::vector<coacd::Mesh> run_coacd(const coacd::Mesh &coacd_mesh, const Ref<CoACDSettings> &settings, int max_convex_hulls, double scale)
+    {
+        std::string preprocess_mode;
+        switch (settings->get_preprocess_mode())
+        {
+        case CoACDSettings::AUTO:
+            preprocess_mode = "auto";
+            break;
+        case CoACDSettings::ON:
+            preprocess_mode = "on";
+            break;
+        case CoACDSettings::OFF:
+            preprocess_mode = "off";
+            break;
+        default:
+            break;
+        }
+
+        std::string approximation_mode;
+        switch (settings->get_approximation_mode())
+        {
+        case CoACDSettings::CONVEX:
+            approximation_mode = "ch";
+            break;
+        case CoACDSettings::BOX:
+            approximation_mode = "box";
+            break;
+        default:
+            break;
+        }
+
+        return coacd::CoACD(
+            coacd_mesh,
+            settings->get_threshold() / scale,
+            max_convex_hulls,
+            preprocess_mode,
+            MAX(5, (int)(settings->get_preprocess_resolution() * scale)),
+            settings->get_sample_resolution(),
+            settings->get_mcts_nodes(),
+            settings->get_mcts_iterations(),
+            settings->get_mcts_max_depth(),
+            settings->get_pca(),
+            settings->get_merge_postprocessing(),
+            settings->get_decimate(),
+            settings->get_max_ch_vertex(),
+            settings->get_extrude(),
+            settings->get_extrude_margin(),
+            approximation_mode,
+            settings->get_seed());
+    }
+
+    Ref<ConvexPolygonShape3D> part_to_shape(const coacd::Mesh &part)
+    {
+        PackedVector3Array convex_points;
+        convex_points.resize(part.indices.size() * 3);
+
+        for (size_t i = 0; i < part.indices.size(); i++)
+        {
+            const auto &triangle = part.indices[i];
+            for (int j = 0; j < 3; j++)
+            {
+                const auto &vertex = part.vertices[triangle[j]];
+                convex_points[i * 3 + j] = Vector3(vertex[0], vertex[1], vertex[2]);
+            }
+        }
+
+        Ref<ConvexPolygonShape3D> convex_shape;
+        convex_shape.instantiate();
+        convex_shape->set_points(convex_points);
+
+        return convex_shape;
+    }
 }
 
 void CoACD::_bind_methods()
 {
     ClassDB::bind_method(D_METHOD("convex_decomposition", "mesh", "settings"), &CoACD::convex_decomposition, DEFVAL(Ref<CoACDSettings>()));
+    ClassDB::bind_method(D_METHOD("incremental_convex_decomposition", "previous_hulls", "mesh", "changed_region", "settings"), &CoACD::incremental_convex_decomposition, DEFVAL(Ref<CoACDSettings>()));
 
     ClassDB::bind_method(D_METHOD("set_log_level", "p_log_level"), &CoACD::set_log_level);
     ClassDB::bind_method(D_METHOD("get_log_level"), &CoACD::get_log_level);
@@ -116,139 +376,108 @@ Array CoACD::convex_decomposition(const Ref<ConcavePolygonShape3D> mesh, Ref<CoA
         settings.instantiate();
     }
 
-    ERR_FAIL_COND_V_EDMSG((settings->get_threshold() > 1), Array(), "CoACD threshold > 1 (should be 0.01-1).");
-    ERR_FAIL_COND_V_EDMSG((settings->get_threshold() < 0.01), Array(), "CoACD threshold < 0.01 (should be 0.01-1).");
-
-    ERR_FAIL_COND_V_EDMSG((settings->get_preprocess_resolution() > 1000), Array(), "CoACD preprocess resolution > 1000 (should be 20-100).");
-    ERR_FAIL_COND_V_EDMSG((settings->get_preprocess_resolution() < 5), Array(), "CoACD preprocess resolution < 5 (should be 20-100).");
+    if (!validate_settings(settings))
+    {
+        return Array();
+    }
 
-    PackedVector3Array points = mesh->get_faces();
+    coacd::Mesh coacd_mesh = build_coacd_mesh(mesh->get_faces());
+    std::vector<coacd::Mesh> convex_parts = run_coacd(coacd_mesh, settings, settings->get_max_convex_hulls(), 1.0);
 
-    coacd::Mesh coacd_mesh;
-    std::vector<Vector3> unique_vertices;
-    std::vector<int> triangle_indices;
+    Array result;
 
-    for (int i = 0; i < points.size(); i += 3)
+    for (const auto &part : convex_parts)
     {
-        const Vector3 &v1 = points[i];
-        const Vector3 &v2 = points[i + 1];
-        const Vector3 &v3 = points[i + 2];
+        result.push_back(part_to_shape(part));
+    }
 
-        for (const Vector3 &v : {v1, v2, v3})
-        {
-            int vertex_idx = -1;
-            for (int j = 0; j < unique_vertices.size(); j++)
-            {
-                if (unique_vertices[j].is_equal_approx(v))
-                {
-                    vertex_idx = j;
-                    break;
-                }
-            }
+    return result;
+}
 
-            if (vertex_idx == -1)
-            {
-                vertex_idx = unique_vertices.size();
-                unique_vertices.push_back(v);
-            }
+Array CoACD::incremental_convex_decomposition(const Array previous_hulls, const Ref<ConcavePolygonShape3D> mesh, const AABB changed_region, Ref<CoACDSettings> settings)
+{
+    ERR_FAIL_COND_V_EDMSG(mesh.is_null(), Array(), "CoACD incremental decomposition requires a valid mesh.");
 
-            triangle_indices.push_back(vertex_idx);
-        }
+    // Without a previous result there is nothing to keep, so bake everything.
+    if (previous_hulls.is_empty())
+    {
+        return convex_decomposition(mesh, settings);
     }
 
-    coacd_mesh.vertices.reserve(unique_vertices.size());
-    for (const Vector3 &v : unique_vertices)
+    if (!settings.is_valid())
     {
-        coacd_mesh.vertices.push_back({v.x, v.y, v.z});
+        settings.instantiate();
     }
 
-    coacd_mesh.indices.reserve(triangle_indices.size() / 3);
-    for (int i = 0; i < triangle_indices.size(); i += 3)
+    if (!validate_settings(settings))
     {
-        coacd_mesh.indices.push_back({triangle_indices[i + 0],
-                                      triangle_indices[i + 1],
-                                      triangle_indices[i + 2]});
+        return Array();
     }
 
-    coacd::Model coacd_model;
-    coacd_model.Load(coacd_mesh.vertices, coacd_mesh.indices);
-    double mesh_vol = coacd::MeshVolume(coacd_model);
-    if (mesh_vol < 0)
+    // Only hulls touching the edit are dropped. Kept hulls may overlap the
+    // new ones near the region border, which is harmless for collision and
+    // keeps one edit from spreading across the whole mesh.
+    const AABB edit_region = changed_region.abs();
+    AABB region = edit_region;
+    Array result;
+
+    for (int i = 0; i < previous_hulls.size(); i++)
     {
-        for (int i = 0; i < (int)coacd_mesh.indices.size(); i++)
-            std::swap(coacd_mesh.indices[i][0], coacd_mesh.indices[i][1]);
+        Ref<ConvexPolygonShape3D> hull = previous_hulls[i];
+        PackedVector3Array hull_points;
+        if (hull.is_valid())
+        {
+            hull_points = hull->get_points();
+        }
+
+        // A rejected entry covers an unknown volume, so nothing can be kept safely.
+        if (hull_points.is_empty())
+        {
+            WARN_PRINT_ED("CoACD previous hull is not a ConvexPolygonShape3D with points, falling back to a full decomposition.");
+            return convex_decomposition(mesh, settings);
+        }
+
+        AABB hull_aabb(hull_points[0], Vector3());
+        for (int j = 1; j < hull_points.size(); j++)
+        {
+            hull_aabb.expand_to(hull_points[j]);
+        }
+
+        if (hull_aabb.intersects_inclusive(edit_region))
+        {
+            region = region.merge(hull_aabb);
+        }
+        else
+        {
+            result.push_back(hull);
+        }
     }
 
-    std::string preprocess_mode;
-    switch (settings->get_preprocess_mode())
+    coacd::Mesh coacd_mesh = build_coacd_mesh(mesh->get_faces());
+    coacd::Mesh region_mesh;
+    if (!clip_to_region(coacd_mesh, region, region_mesh))
     {
-    case CoACDSettings::AUTO:
-        preprocess_mode = "auto";
-        break;
-    case CoACDSettings::ON:
-        preprocess_mode = "on";
-        break;
-    case CoACDSettings::OFF:
-        preprocess_mode = "off";
-        break;
-    default:
-        break;
+        WARN_PRINT_ED("CoACD could not clip the mesh to the changed region, falling back to a full decomposition.");
+        return convex_decomposition(mesh, settings);
     }
 
-    std::string approximation_mode;
-    switch (settings->get_approximation_mode())
+    if (region_mesh.indices.empty())
     {
-    case CoACDSettings::CONVEX:
-        approximation_mode = "ch";
-        break;
-    case CoACDSettings::BOX:
-        approximation_mode = "box";
-        break;
-    default:
-        break;
+        return result;
     }
 
-    std::vector<coacd::Mesh> convex_parts = coacd::CoACD(
-        coacd_mesh,
-        settings->get_threshold(),
-        settings->get_max_convex_hulls(),
-        preprocess_mode,
-        settings->get_preprocess_resolution(),
-        settings->get_sample_resolution(),
-        settings->get_mcts_nodes(),
-        settings->get_mcts_iterations(),
-        settings->get_mcts_max_depth(),
-        settings->get_pca(),
-        settings->get_merge_postprocessing(),
-        settings->get_decimate(),
-        settings->get_max_ch_vertex(),
-        settings->get_extrude(),
-        settings->get_extrude_margin(),
-        approximation_mode,
-        settings->get_seed());
+    int max_convex_hulls = settings->get_max_convex_hulls();
+    if (max_convex_hulls > 0)
+    {
+        max_convex_hulls = MAX(1, max_convex_hulls - (int)result.size());
+    }
 
-    Array result;
+    double scale = longest_extent(region_mesh) / longest_extent(coacd_mesh);
+    std::vector<coacd::Mesh> convex_parts = run_coacd(region_mesh, settings, max_convex_hulls, scale);
 
     for (const auto &part : convex_parts)
     {
-        PackedVector3Array convex_points;
-        convex_points.resize(part.indices.size() * 3);
-
-        for (size_t i = 0; i < part.indices.size(); i++)
-        {
-            const auto &triangle = part.indices[i];
-            for (int j = 0; j < 3; j++)
-            {
-                const auto &vertex = part.vertices[triangle[j]];
-                convex_points[i * 3 + j] = Vector3(vertex[0], vertex[1], vertex[2]);
-            }
-        }
-
-        Ref<ConvexPolygonShape3D> convex_shape;
-        convex_shape.instantiate();
-        convex_shape->set_points(convex_points);
-
-        result.push_back(convex_shape);
+        result.push_back(part_to_shape(part));
     }
 
     return result;
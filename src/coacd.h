@@ -34,6 +34,7 @@ namespace godot
 		};
 
 		Array convex_decomposition(const Ref<ConcavePolygonShape3D> mesh, const Ref<CoACDSettings> = Ref<CoACDSettings>());
+		Array incremental_convex_decomposition(const Array previous_hulls, const Ref<ConcavePolygonShape3D> mesh, const AABB changed_region, const Ref<CoACDSettings> = Ref<CoACDSettings>());
 
 		void set_log_level(LogLevels p_log_level);
 		LogLevels get_log_level();